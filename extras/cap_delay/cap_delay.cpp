@@ -30,6 +30,25 @@ const int sample_size = 511;
 */
 const int data_interval = 1000;
 
+/* Automatic Capacitor Delay Search
+ * When true the rotary encoder is ignored and cap_time_delay is found with a binary search.
+ * Each delay tried is run for bursts_per_trial bursts and compared against a baseline taken
+ * at search_max_delay, where the cap is assumed to be fully charged.
+ * Every burst is checked on its own. A burst fails if its Skew is below skew_limit, its Slope is
+ * more than slope_margin above the highest baseline Slope, or its StdDev is more than
+ * std_dev_factor times the highest baseline StdDev. A delay passes only if no burst fails.
+ * The minimal passing delay is reported along with a recommended delay of that plus safety_margin.
+ * Once the search completes the encoder works as normal starting from the recommended delay.
+*/
+const bool auto_search = true;
+const int search_min_delay = 0;      // Shortest delay (ms) the search will try.
+const int search_max_delay = 100;    // Must be long enough to fully charge the cap.
+const int bursts_per_trial = 60;     // Failure rate bound is 3/bursts_per_trial (5% for 60).
+const int skew_limit = -1;           // Any burst with a Skew below this fails the trial.
+const float slope_margin = 0.01;     // Allowed rise in Slope above the highest baseline Slope.
+const float std_dev_factor = 1.25;   // Allowed ratio of StdDev to the highest baseline StdDev.
+const int safety_margin = 5;         // Time in ms added to the minimal delay for the recommendation.
+
 // Baud rate for serial communication.
 const unsigned long BAUD_RATE = 115200;
 
@@ -51,6 +70,26 @@ int cap_time_delay = 0; // Holds selected time in ms to charge bypass capacitor
 bool fetching_ADC_data = false;
 bool print_buffer = false;
 
+enum class SearchState {
+    BASELINE,
+    SEARCHING,
+    COMPLETE
+};
+
+// Accumulates burst results for the delay currently being tried.
+struct TrialStats {
+    int bursts;
+    int min_skew;
+    float max_slope;
+    float max_std_dev;
+};
+
+SearchState search_state = SearchState::COMPLETE;
+TrialStats trial = {0, 0, 0.0, 0.0};
+float slope_limit = 0.0;    // Set from the baseline.
+float std_dev_limit = 0.0;  // Set from the baseline.
+int search_low = 0;   // Longest delay known to fail.
+int search_high = 0;  // Shortest delay known to pass.
 
 AiEsp32RotaryEncoder rotaryEncoder = AiEsp32RotaryEncoder(ENCODER_B_PIN, ENCODER_A_PIN, ENCODER_BUTTON_PIN, ENCODER_VCC_PIN, ENCODER_STEPS);
 MillisChronoTimer cap_charge_timer(cap_time_delay);
@@ -73,6 +112,9 @@ void resetBuffers() {
 void readRotaryEncoder() {
     // .encoderChanged only triggers if encoder rotates and gets a different value.
     if (rotaryEncoder.encoderChanged()) {
+        if (search_state != SearchState::COMPLETE) {
+            return;  // Encoder is ignored during auto search.
+        }
         int value = rotaryEncoder.readEncoder();
         cap_time_delay = value;
         cap_charge_timer.modify(cap_time_delay);
@@ -101,6 +143,121 @@ void printBuffer() {
 }
 
 
+// Start a new trial at delay ms and discard any partially filled buffer.
+void startTrial(int delay) {
+    cap_time_delay = delay;
+    cap_charge_timer.modify(cap_time_delay);
+    trial = {0, 0, 0.0, 0.0};
+    resetBuffers();
+}
+
+
+bool burstPassed(float slope, int skew, float std_dev) {
+    return skew >= skew_limit
+        && slope <= slope_limit
+        && std_dev <= std_dev_limit;
+}
+
+
+void reportSearchResult() {
+    int recommended = search_high + safety_margin;
+    Serial.println("\nAUTO_SEARCH COMPLETE");
+    Serial.print("Minimal Passing Delay(ms): ");
+    Serial.println(search_high);
+    Serial.print("Recommended Delay(ms): ");
+    Serial.println(recommended);
+    // Rule of three: zero failures in n bursts bounds the failure rate below 3/n at 95% confidence.
+    Serial.print("Confidence: 0 of ");
+    Serial.print(bursts_per_trial);
+    Serial.print(" bursts failed any check at minimal passing delay, failure rate < ");
+    Serial.print(300.0 / bursts_per_trial, 1);
+    Serial.println("% (95%)");
+    Serial.println();
+
+    search_state = SearchState::COMPLETE;
+    startTrial(recommended);
+    rotaryEncoder.setEncoderValue(recommended);
+}
+
+
+void moveToNextTrial() {
+    if (search_high - search_low <= 1) {
+        reportSearchResult();
+    } else {
+        startTrial(search_low + (search_high - search_low) / 2);
+    }
+}
+
+
+// Set the per burst limits once every baseline burst has been collected.
+void evaluateBaseline() {
+    if (trial.min_skew < skew_limit) {
+        Serial.println("\nAUTO_SEARCH FAILED: Cap not charged at search_max_delay.");
+        Serial.println("Increase search_max_delay or data_interval.");
+        search_state = SearchState::COMPLETE;
+        rotaryEncoder.setEncoderValue(cap_time_delay);
+        return;
+    }
+    slope_limit = trial.max_slope + slope_margin;
+    std_dev_limit = trial.max_std_dev * std_dev_factor;
+    search_low = search_min_delay - 1;
+    search_high = search_max_delay;
+    search_state = SearchState::SEARCHING;
+    Serial.print("\nBASELINE   MaxSlope: ");
+    Serial.print(trial.max_slope);
+    Serial.print("   MaxStdDev: ");
+    Serial.println(trial.max_std_dev);
+    moveToNextTrial();
+}
+
+
+// A trial fails on its first failed burst, so only passing delays run every burst.
+void endTrial(bool passed, float slope, int skew, float std_dev) {
+    if (passed) {
+        search_high = cap_time_delay;
+    } else {
+        search_low = cap_time_delay;
+    }
+    Serial.print("\nTRIAL CAP_DELAY: ");
+    Serial.print(cap_time_delay);
+    if (passed) {
+        Serial.print("   PASS   Bursts: ");
+        Serial.println(trial.bursts);
+    } else {
+        Serial.print("   FAIL at burst ");
+        Serial.print(trial.bursts);
+        Serial.print("   Skew: ");
+        Serial.print(skew);
+        Serial.print("   Slope: ");
+        Serial.print(slope);
+        Serial.print("   StdDev: ");
+        Serial.println(std_dev);
+    }
+    moveToNextTrial();
+}
+
+
+void recordBurst(float slope, int skew, float std_dev) {
+    if (trial.bursts == 0) {
+        trial = {0, skew, slope, std_dev};
+    }
+    trial.min_skew = std::min(trial.min_skew, skew);
+    trial.max_slope = std::max(trial.max_slope, slope);
+    trial.max_std_dev = std::max(trial.max_std_dev, std_dev);
+    trial.bursts++;
+
+    if (search_state == SearchState::BASELINE) {
+        if (trial.bursts >= bursts_per_trial) {
+            evaluateBaseline();
+        }
+    } else if (!burstPassed(slope, skew, std_dev)) {
+        endTrial(false, slope, skew, std_dev);
+    } else if (trial.bursts >= bursts_per_trial) {
+        endTrial(true, slope, skew, std_dev);
+    }
+}
+
+
 void setup() {
     Serial.begin(BAUD_RATE);
     pinMode(THERMISTOR_INPUT_PIN, INPUT);
@@ -113,6 +270,12 @@ void setup() {
     rotaryEncoder.setEncoderValue(cap_time_delay);  // Time in ms to charge bypass capacitor
     resetBuffers();
 
+    if (auto_search) {
+        Serial.println("\nAUTO_SEARCH");
+        search_state = SearchState::BASELINE;
+        startTrial(search_max_delay);
+    }
+
 }
 
 
@@ -133,6 +296,7 @@ void loop() {
         fetching_ADC_data = false;
         float slope = ADC_probe.getSlope();
         int skew = ADC_probe.getLeftSkew(skew_deviations);
+        float std_dev = ADC_probe.getStdDev();
         if (print_buffer) {
             printBuffer();
         }
@@ -151,7 +315,7 @@ void loop() {
         }
         Serial.print(skew);
         Serial.print("   StdDev: ");
-        Serial.print(ADC_probe.getStdDev());
+        Serial.print(std_dev);
         Serial.print("   Median: ");
         Serial.print(ADC_probe.getMedian());
         Serial.print("   Time(ms): ");
@@ -162,6 +326,10 @@ void loop() {
             Serial.println("WARNING: Data Collection taking longer than data_interval.");
             Serial.println("Increase data_interval if you need a longer cap delay.");
         }
+
+        if (search_state != SearchState::COMPLETE) {
+            recordBurst(slope, skew, std_dev);
+        }
     }
     readRotaryEncoder();
     handleRotaryButton();
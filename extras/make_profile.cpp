@@ -0,0 +1,106 @@
+/*
+Creates a binary calibration profile for the SD card.
+Copy the output file to the SD card using the name in PROFILE_NAME (preferences.h).
+Then a new calibration only needs a new file, not a rebuild and reflash.
+
+Build:  g++ -std=c++11 -o make_profile make_profile.cpp
+Usage:  ./make_profile [--no-table] thermistor.cal MAX_RAW A B C D [MAX_RAW A B C D ...]
+  * --no-table leaves out the precomputed table (about 16KB). It is computed at startup instead.
+  * Each group of 5 values is one cubic formula segment: TempF = A+Bx+C*x^2+D*x^3
+  * MAX_RAW is the highest ADC reading (0-4095) the segment is used for.
+  * Segments must be in order from lowest to highest MAX_RAW.
+  * The last segment is used for all readings above its MAX_RAW.
+
+Example matching the defaults in preferences.h:
+  ./make_profile thermistor.cal 2019 233.2 -0.09784 2.401E-05 -3.491E-09 4095 233.2 -0.09784 2.401E-05 -3.491E-09
+*/
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include "../src/calibration_profile.h"
+
+using namespace std;
+
+// Parse a whole argument as a float. Returns false on trailing garbage.
+bool parseFloat(const char *arg, float &value) {
+    char *end;
+    value = strtof(arg, &end);
+    return end != arg && *end == '\0' && isfinite(value);
+}
+
+
+bool parseMaxRaw(const char *arg, int16_t &value) {
+    char *end;
+    long raw = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || raw < 0 || raw >= PROFILE_TABLE_SIZE) {
+        return false;
+    }
+    value = static_cast<int16_t>(raw);
+    return true;
+}
+
+
+int usage(const char *name) {
+    cerr << "Usage: " << name << " [--no-table] FILE MAX_RAW A B C D [MAX_RAW A B C D ...]" << endl;
+    cerr << "Up to " << PROFILE_MAX_SEGMENTS << " segments. MAX_RAW must be 0-"
+         << PROFILE_TABLE_SIZE - 1 << "." << endl;
+    return 1;
+}
+
+
+int main(int argc, char *argv[]) {
+    int first = 1;
+    bool include_table = true;
+    if (argc > 1 && strcmp(argv[1], "--no-table") == 0) {
+        include_table = false;
+        first++;
+    }
+    const char *file_name = argv[first];
+    int segment_args = argc - first - 1;
+    if (segment_args < 5 || segment_args % 5 != 0 || segment_args / 5 > PROFILE_MAX_SEGMENTS) {
+        return usage(argv[0]);
+    }
+
+    static CalibrationProfile profile = {};
+    profile.magic = PROFILE_MAGIC;
+    profile.version = PROFILE_VERSION;
+    profile.segment_count = segment_args / 5;
+    for (int i = 0; i < profile.segment_count; ++i) {
+        char **arg = &argv[first + 1 + i * 5];
+        ProfileSegment &seg = profile.segments[i];
+        if (!parseMaxRaw(arg[0], seg.max_raw)) {
+            cerr << "Invalid MAX_RAW: " << arg[0] << endl;
+            return usage(argv[0]);
+        }
+        float *coeff[] = {&seg.a, &seg.b, &seg.c, &seg.d};
+        for (int c = 0; c < 4; ++c) {
+            if (!parseFloat(arg[1 + c], *coeff[c])) {
+                cerr << "Invalid constant: " << arg[1 + c] << endl;
+                return usage(argv[0]);
+            }
+        }
+    }
+    if (include_table) {
+        precomputeProfileTable(profile);
+    }
+    profile.checksum = profileChecksum(profile);
+
+    if (!profileValid(profile)) {
+        cerr << "Invalid profile. Check that MAX_RAW values are increasing." << endl;
+        return 1;
+    }
+
+    size_t file_size = profileFileSize(profile);
+    ofstream out(file_name, ios::binary);
+    out.write(reinterpret_cast<const char *>(&profile), file_size);
+    if (!out) {
+        cerr << "Error writing " << file_name << endl;
+        return 1;
+    }
+
+    cout << "Wrote " << file_size << " bytes to " << file_name << endl;
+    cout << "ADC 0: " << profileSegmentTemp(profile, 0) << "   ADC " << PROFILE_TABLE_SIZE - 1 << ": "
+         << profileSegmentTemp(profile, PROFILE_TABLE_SIZE - 1) << endl;
+    return 0;
+}
@@ -0,0 +1,429 @@
+/*
+Replays a raw sample capture from RECORD_DATA (capture_raw = true in preferences.h).
+Every combination of sample size, median/average and running average filter is reduced
+and fit with a cubic formula so they can be compared without another cool-down.
+Configurations are run in parallel, one per thread.
+
+Build:  g++ -std=c++11 -O2 -pthread -o replay replay.cpp
+Usage:  ./replay probe_raw.bin [-s SIZES] [-m median|average|both] [-f FILTERS] [-c CUTOFFS] [-j THREADS]
+  -s  Comma separated sample sizes. Default is every buffer size up to the captured size.
+  -f  Comma separated running average lengths applied to the median/average values.
+      The temps are averaged over the same window so they stay lined up.
+      1 means no filter. Default is 1,4,8.
+  -c  Comma separated ADC cutoffs that split the fit into one cubic per segment, the same as
+      upper_cutoff in preferences.h or MAX_RAW in make_profile. Up to 3 cutoffs (4 segments).
+      "none" fits a single cubic. Repeat -c to compare several splits. Default is none.
+  -j  Number of threads. Default is the number of cores.
+
+Output is CSV sorted from best to worst fit (RMS error in °F).
+  * FitRMS/FitMax: error of the cubic fit against the DS18B20 temps.
+  * Noise: std deviation of the median/average values in ADC counts, before the filter.
+    Taken from second differences between bursts so the cooling trend is removed. Lower is smoother.
+  * Segments: "MAX_RAW A B C D" for each segment, ready to paste after the file name for
+    make_profile. The last segment has MAX_RAW 4095. With one cutoff, the first group is
+    upper_cutoff and uA..uD in preferences.h and the second is A..D.
+*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include "../../src/raw_capture.h"
+#include "../../src/calibration_profile.h"
+
+using namespace std;
+
+// Same sizes as buffer_sizes in preferences.h.
+const int default_sizes[] = {15, 31, 65, 129, 255, 511, 1025, 2049, 4095};
+
+struct Burst {
+    float tempF;
+    vector<int16_t> samples;
+};
+
+struct Config {
+    int sample_size;
+    bool use_median;
+    int filter_length;
+    const vector<int> *cutoffs;  // MAX_RAW of every segment except the last.
+};
+
+struct Segment {
+    int max_raw;
+    double coeff[4];  // A, B, C, D
+};
+
+struct Result {
+    Config config;
+    int points;
+    double fit_rms;
+    double fit_max;
+    double noise;
+    vector<Segment> segments;  // Empty if any segment could not be fit.
+};
+
+
+bool loadCapture(const char *file_name, vector<Burst> &bursts, int &sample_size) {
+    ifstream in(file_name, ios::binary);
+    RawCaptureHeader header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header))) {
+        return false;
+    }
+    if (header.magic != RAW_CAPTURE_MAGIC || header.version != RAW_CAPTURE_VERSION) {
+        cerr << "Not a raw capture file or wrong version." << endl;
+        return false;
+    }
+    sample_size = header.sample_size;
+
+    RawBurstHeader burst_header;
+    vector<uint8_t> encoded;
+    while (in.read(reinterpret_cast<char *>(&burst_header), sizeof(burst_header))) {
+        encoded.resize(burst_header.encoded_bytes);
+        if (!in.read(reinterpret_cast<char *>(encoded.data()), encoded.size())) {
+            cerr << "Warning: capture ends with a partial burst." << endl;
+            break;
+        }
+        // Every burst must be full size or smaller sample sizes would read past the end.
+        if (burst_header.count == 0 || burst_header.count != header.sample_size) {
+            cerr << "Error: burst " << bursts.size() << " has " << burst_header.count
+                 << " samples, expected " << header.sample_size << "." << endl;
+            return false;
+        }
+        Burst burst;
+        burst.tempF = burst_header.tempF;
+        burst.samples.resize(burst_header.count);
+        if (!decodeSamples(encoded.data(), encoded.size(), burst_header.count, burst.samples.data())) {
+            cerr << "Error: burst " << bursts.size() << " is corrupt." << endl;
+            return false;
+        }
+        bursts.push_back(burst);
+    }
+    return true;
+}
+
+
+// Median or rounded average of the first n samples, the same as the controller would see.
+int reduceBurst(const Burst &burst, int n, bool use_median) {
+    if (use_median) {
+        vector<int16_t> sorted(burst.samples.begin(), burst.samples.begin() + n);
+        nth_element(sorted.begin(), sorted.begin() + n / 2, sorted.end());
+        return sorted[n / 2];
+    }
+    long sum = 0;
+    for (int i = 0; i < n; ++i) {
+        sum += burst.samples[i];
+    }
+    return static_cast<int>(round(static_cast<double>(sum) / n));
+}
+
+
+/*
+ * Least squares cubic fit of y = A+Bx+C*x^2+D*x^3.
+ * x is scaled to 0-1 while solving to keep the normal equations well conditioned.
+ */
+bool fitCubic(const vector<double> &x, const vector<double> &y, double coeff[4]) {
+    const double scale = 4096.0;
+    double m[4][5] = {};
+    for (size_t i = 0; i < x.size(); ++i) {
+        double xs = x[i] / scale;
+        double p[4] = {1.0, xs, xs * xs, xs * xs * xs};
+        for (int r = 0; r < 4; ++r) {
+            for (int c = 0; c < 4; ++c) {
+                m[r][c] += p[r] * p[c];
+            }
+            m[r][4] += p[r] * y[i];
+        }
+    }
+    // Gaussian elimination with partial pivoting.
+    for (int col = 0; col < 4; ++col) {
+        int pivot = col;
+        for (int r = col + 1; r < 4; ++r) {
+            if (fabs(m[r][col]) > fabs(m[pivot][col])) {
+                pivot = r;
+            }
+        }
+        if (fabs(m[pivot][col]) < 1e-12) {
+            return false;
+        }
+        for (int c = 0; c < 5; ++c) {
+            swap(m[col][c], m[pivot][c]);
+        }
+        for (int r = 0; r < 4; ++r) {
+            if (r != col) {
+                double factor = m[r][col] / m[col][col];
+                for (int c = col; c < 5; ++c) {
+                    m[r][c] -= factor * m[col][c];
+                }
+            }
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        coeff[i] = m[i][4] / m[i][i] / pow(scale, i);
+    }
+    return true;
+}
+
+
+Result runConfig(const vector<Burst> &bursts, const Config &config) {
+    Result result = {config, 0, NAN, NAN, NAN, {}};
+    vector<int> reduced(bursts.size());
+    for (size_t i = 0; i < bursts.size(); ++i) {
+        reduced[i] = reduceBurst(bursts[i], config.sample_size, config.use_median);
+    }
+
+    /*
+     * Running average of the last filter_length reduced values.
+     * The temps get the same running average, so each filtered value is paired with the
+     * temp at the center of its window instead of the newest one.
+     */
+    vector<double> x, y;
+    double reduced_sum = 0;
+    double temp_sum = 0;
+    for (size_t i = 0; i < reduced.size(); ++i) {
+        reduced_sum += reduced[i];
+        temp_sum += bursts[i].tempF;
+        if (i >= static_cast<size_t>(config.filter_length)) {
+            reduced_sum -= reduced[i - config.filter_length];
+            temp_sum -= bursts[i - config.filter_length].tempF;
+        }
+        if (i + 1 >= static_cast<size_t>(config.filter_length)) {
+            x.push_back(reduced_sum / config.filter_length);
+            y.push_back(temp_sum / config.filter_length);
+        }
+    }
+
+    // Second differences remove the cooling trend, leaving noise (variance of d2 is 6x sigma^2).
+    if (reduced.size() >= 3) {
+        double d2_sum_sq = 0;
+        for (size_t i = 2; i < reduced.size(); ++i) {
+            double d2 = reduced[i] - 2.0 * reduced[i - 1] + reduced[i - 2];
+            d2_sum_sq += d2 * d2;
+        }
+        result.noise = sqrt(d2_sum_sq / (reduced.size() - 2) / 6.0);
+    }
+    result.points = x.size();
+
+    // Fit one cubic per segment. A reading belongs to the first segment with x <= MAX_RAW.
+    vector<Segment> segments;
+    for (int cutoff : *config.cutoffs) {
+        segments.push_back({cutoff, {}});
+    }
+    segments.push_back({PROFILE_TABLE_SIZE - 1, {}});
+    vector<int> owner(x.size());
+    for (size_t seg = 0; seg < segments.size(); ++seg) {
+        int low = seg == 0 ? -1 : segments[seg - 1].max_raw;
+        bool last = seg + 1 == segments.size();
+        vector<double> seg_x, seg_y;
+        for (size_t i = 0; i < x.size(); ++i) {
+            if (x[i] > low && (last || x[i] <= segments[seg].max_raw)) {
+                seg_x.push_back(x[i]);
+                seg_y.push_back(y[i]);
+                owner[i] = seg;
+            }
+        }
+        if (seg_x.size() < 4 || !fitCubic(seg_x, seg_y, segments[seg].coeff)) {
+            return result;
+        }
+    }
+
+    double sum_sq = 0;
+    double max_err = 0;
+    for (size_t i = 0; i < x.size(); ++i) {
+        const double *c = segments[owner[i]].coeff;
+        double fit = c[0] + c[1] * x[i] + c[2] * pow(x[i], 2) + c[3] * pow(x[i], 3);
+        double err = fabs(fit - y[i]);
+        sum_sq += err * err;
+        max_err = max(max_err, err);
+    }
+    result.fit_rms = sqrt(sum_sq / x.size());
+    result.fit_max = max_err;
+    result.segments = segments;
+    return result;
+}
+
+
+// Parse a whole argument as a positive integer. Returns false on anything else.
+bool parsePositive(const string &arg, int &value) {
+    char *end;
+    long parsed = strtol(arg.c_str(), &end, 10);
+    if (end == arg.c_str() || *end != '\0' || parsed < 1 || parsed > 65535) {
+        return false;
+    }
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+
+// Parse a comma separated list of positive integers. Returns false if any item is invalid.
+bool parseList(const char *arg, vector<int> &values) {
+    values.clear();
+    stringstream ss(arg);
+    string item;
+    while (getline(ss, item, ',')) {
+        int value;
+        if (!parsePositive(item, value)) {
+            return false;
+        }
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+
+// Parse "none" or increasing ADC cutoffs below 4095, leaving room for the last segment.
+bool parseCutoffs(const char *arg, vector<int> &cutoffs) {
+    cutoffs.clear();
+    if (string(arg) == "none") {
+        return true;
+    }
+    if (!parseList(arg, cutoffs) || static_cast<int>(cutoffs.size()) >= PROFILE_MAX_SEGMENTS) {
+        return false;
+    }
+    for (size_t i = 0; i < cutoffs.size(); ++i) {
+        if (cutoffs[i] >= PROFILE_TABLE_SIZE - 1 || (i > 0 && cutoffs[i] <= cutoffs[i - 1])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int usage(const char *name) {
+    cerr << "Usage: " << name << " FILE [-s SIZES] [-m median|average|both] [-f FILTERS] [-c CUTOFFS] [-j THREADS]" << endl;
+    cerr << "SIZES and FILTERS are comma separated positive integers." << endl;
+    cerr << "CUTOFFS is none or up to " << PROFILE_MAX_SEGMENTS - 1
+         << " increasing ADC values below " << PROFILE_TABLE_SIZE - 1 << ". -c may be repeated." << endl;
+    return 1;
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        return usage(argv[0]);
+    }
+
+    vector<int> sizes;
+    vector<int> filters = {1, 4, 8};
+    string method = "both";
+    vector<vector<int>> cutoff_sets;
+    int threads = max(1u, thread::hardware_concurrency());
+    for (int i = 2; i < argc; i += 2) {
+        string opt = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "Missing value for " << opt << endl;
+            return usage(argv[0]);
+        }
+        const char *value = argv[i + 1];
+        bool valid;
+        if (opt == "-s") {
+            valid = parseList(value, sizes);
+        } else if (opt == "-f") {
+            valid = parseList(value, filters);
+        } else if (opt == "-m") {
+            method = value;
+            valid = method == "median" || method == "average" || method == "both";
+        } else if (opt == "-c") {
+            cutoff_sets.emplace_back();
+            valid = parseCutoffs(value, cutoff_sets.back());
+        } else if (opt == "-j") {
+            valid = parsePositive(value, threads);
+        } else {
+            cerr << "Unknown option: " << opt << endl;
+            return usage(argv[0]);
+        }
+        if (!valid) {
+            cerr << "Invalid value for " << opt << ": " << value << endl;
+            return usage(argv[0]);
+        }
+    }
+
+    vector<Burst> bursts;
+    int captured_size = 0;
+    if (!loadCapture(argv[1], bursts, captured_size)) {
+        cerr << "Error reading " << argv[1] << endl;
+        return 1;
+    }
+    cerr << "Loaded " << bursts.size() << " bursts of " << captured_size << " samples." << endl;
+
+    if (sizes.empty()) {
+        for (int size : default_sizes) {
+            if (size <= captured_size) {
+                sizes.push_back(size);
+            }
+        }
+    }
+
+    if (cutoff_sets.empty()) {
+        cutoff_sets.emplace_back();  // Single cubic.
+    }
+
+    vector<Config> configs;
+    for (int size : sizes) {
+        if (size < 1 || size > captured_size) {
+            cerr << "Skipping sample size " << size << ": capture only has " << captured_size << endl;
+            continue;
+        }
+        for (int filter : filters) {
+            for (const vector<int> &cutoffs : cutoff_sets) {
+                if (method != "average") {
+                    configs.push_back({size, true, filter, &cutoffs});
+                }
+                if (method != "median") {
+                    configs.push_back({size, false, filter, &cutoffs});
+                }
+            }
+        }
+    }
+
+    // Each thread takes the next unfinished config until none are left.
+    vector<Result> results(configs.size());
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            for (size_t i = next++; i < configs.size(); i = next++) {
+                results[i] = runConfig(bursts, configs[i]);
+            }
+        });
+    }
+    for (thread &worker : workers) {
+        worker.join();
+    }
+
+    // NaN results (too few points to fit) sort last.
+    sort(results.begin(), results.end(), [](const Result &a, const Result &b) {
+        if (isnan(a.fit_rms)) return false;
+        if (isnan(b.fit_rms)) return true;
+        return a.fit_rms < b.fit_rms;
+    });
+
+    cout << "SampleSize,Method,Filter,Points,FitRMS,FitMax,Noise,Segments" << endl;
+    for (const Result &r : results) {
+        cout << r.config.sample_size << ","
+             << (r.config.use_median ? "median" : "average") << ","
+             << r.config.filter_length << ","
+             << r.points << ","
+             << fixed << setprecision(4) << r.fit_rms << ","
+             << r.fit_max << ","
+             << r.noise << ",";
+        if (r.segments.empty()) {
+            cout << "too few points to fit";
+        }
+        for (size_t seg = 0; seg < r.segments.size(); ++seg) {
+            const Segment &s = r.segments[seg];
+            cout << (seg > 0 ? " " : "") << s.max_raw << scientific << setprecision(6);
+            for (double c : s.coeff) {
+                cout << " " << c;
+            }
+            cout << defaultfloat;
+        }
+        cout << endl;
+    }
+    return 0;
+}
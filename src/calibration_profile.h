@@ -0,0 +1,127 @@
+#ifndef CALIBRATION_PROFILE_H
+#define CALIBRATION_PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+
+/* Binary Calibration Profile
+ * Holds the cubic formula constants for one or more ADC ranges plus an optional
+ * precomputed ADC to TempF table. A file is the header and segments, followed by the
+ * table only if table_size is not 0. Either way it is loaded from the SD card with a
+ * single block read at startup. Without a table one is precomputed after loading.
+ * Shared with ./extras/make_profile.cpp which creates profile files on a computer.
+ *
+ * Layout is little-endian with no implicit padding so the same file works on the
+ * ESP32 and on a desktop machine. Change PROFILE_VERSION whenever the layout changes.
+*/
+const uint32_t PROFILE_MAGIC = 0x50414354;  // "TCAP" in a little-endian file
+const uint16_t PROFILE_VERSION = 1;
+const int PROFILE_MAX_SEGMENTS = 4;
+const int PROFILE_TABLE_SIZE = 4096;  // One entry for every 12-bit ADC value.
+
+/* One cubic formula: TempF = a+bx+c*x^2+d*x^3
+ * Used for ADC readings at or below max_raw that are above the previous segment.
+ * Segments are sorted from lowest to highest max_raw (highest to lowest temp for NTC).
+*/
+struct ProfileSegment {
+    int16_t max_raw;
+    uint16_t reserved;
+    float a;
+    float b;
+    float c;
+    float d;
+};
+
+struct CalibrationProfile {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t segment_count;
+    uint16_t table_size;  // 0 if the file has no precomputed table.
+    uint16_t reserved;
+    uint32_t checksum;    // CRC-32 of every other byte in the file.
+    ProfileSegment segments[PROFILE_MAX_SEGMENTS];
+    float table[PROFILE_TABLE_SIZE];  // Not in the file when table_size is 0.
+};
+
+static_assert(sizeof(ProfileSegment) == 20, "ProfileSegment layout changed");
+static_assert(sizeof(CalibrationProfile) == 16 + 20 * PROFILE_MAX_SEGMENTS + 4 * PROFILE_TABLE_SIZE,
+              "CalibrationProfile layout changed");
+
+const size_t PROFILE_MIN_FILE_SIZE = offsetof(CalibrationProfile, table);
+
+
+// Number of bytes the profile takes in a file.
+inline size_t profileFileSize(const CalibrationProfile &profile) {
+    return profile.table_size == 0 ? PROFILE_MIN_FILE_SIZE : sizeof(CalibrationProfile);
+}
+
+
+// Standard CRC-32 (same as zlib). Bitwise to avoid a 1KB lookup table.
+inline uint32_t crc32Update(uint32_t crc, const uint8_t *bytes, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return crc;
+}
+
+
+// CRC-32 of the file bytes before and after the checksum field.
+inline uint32_t profileChecksum(const CalibrationProfile &profile) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&profile);
+    size_t before = offsetof(CalibrationProfile, checksum);
+    size_t after = before + sizeof(profile.checksum);
+    uint32_t crc = crc32Update(0xFFFFFFFF, bytes, before);
+    crc = crc32Update(crc, bytes + after, profileFileSize(profile) - after);
+    return ~crc;
+}
+
+
+// Returns false if the header, segments or checksum are not usable.
+inline bool profileValid(const CalibrationProfile &profile) {
+    if (profile.magic != PROFILE_MAGIC || profile.version != PROFILE_VERSION) {
+        return false;
+    }
+    if (profile.segment_count < 1 || profile.segment_count > PROFILE_MAX_SEGMENTS) {
+        return false;
+    }
+    if (profile.table_size != 0 && profile.table_size != PROFILE_TABLE_SIZE) {
+        return false;
+    }
+    for (int i = 1; i < profile.segment_count; ++i) {
+        if (profile.segments[i].max_raw <= profile.segments[i - 1].max_raw) {
+            return false;
+        }
+    }
+    return profile.checksum == profileChecksum(profile);
+}
+
+
+// Evaluate the cubic formula for ADC_raw. Readings above the last segment use the last segment.
+inline float profileSegmentTemp(const CalibrationProfile &profile, int ADC_raw) {
+    int last = profile.segment_count - 1;
+    const ProfileSegment *seg = &profile.segments[last];
+    for (int i = 0; i < last; ++i) {
+        if (ADC_raw <= profile.segments[i].max_raw) {
+            seg = &profile.segments[i];
+            break;
+        }
+    }
+    int x = ADC_raw;
+    return seg->a+(seg->b*x)+(seg->c*pow(x,2))+(seg->d*pow(x,3));
+}
+
+
+// Fill the table from the segments so later lookups need no polynomial math.
+inline void precomputeProfileTable(CalibrationProfile &profile) {
+    for (int raw = 0; raw < PROFILE_TABLE_SIZE; ++raw) {
+        profile.table[raw] = profileSegmentTemp(profile, raw);
+    }
+    profile.table_size = PROFILE_TABLE_SIZE;
+}
+
+
+#endif // CALIBRATION_PROFILE_H
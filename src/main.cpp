@@ -1,5 +1,6 @@
 #include <Arduino.h>
 #include <algorithm>
+#include <vector>
 #include <AiEsp32RotaryEncoder.h>   // https://github.com/igorantolic/ai-esp32-rotary-encoder
 #include <OneWire.h>                // https://github.com/PaulStoffregen/OneWire
 // Reduce code needed for DallasTemperature.h
@@ -12,6 +13,9 @@
 #include <VectorStats.h>            // https://github.com/Steve8291/VectorStats
 #include <MillisChronoTimer.h>      // https://github.com/Steve8291/MillisChronoTimer
 #include "preferences.h"
+#include "calibration_profile.h"
+#include "raw_capture.h"
+#include "thermal_lag.h"
 #define FILE_TRUNC_WRITE (O_WRITE | O_CREAT | O_TRUNC | O_AT_END)
 
 // Set max_buffer_size to largest value in buffer_sizes array.
@@ -40,12 +44,15 @@ DallasTemperature sensors(&oneWire);
 DeviceAddress calibration_probe_addr;  // Array to hold the calibration probe address.
 SdFs SD;  // FAT16/FAT32/exFAT filesystems
 FsFile dataFile;
+FsFile rawFile;
+std::vector<uint8_t> raw_encode_buffer;  // Holds one encoded burst when capture_raw is true.
 MillisChronoTimer data_interval_timer(data_interval);
 MillisChronoTimer temp_request_timer(TEMP_CONVERSION_TIME);
 MillisChronoTimer end_temp_timer(END_TEMP_TIME);
 VectorStats<int16_t> ADC_probe(max_buffer_size);  // Holds analog readings from ADC
 VectorStats<int16_t> std_dev_buffer_mdn(std_dev_sample_size);  // Holds median values from ADC_probe.
 VectorStats<int16_t> std_dev_buffer_avg(std_dev_sample_size);  // Holds average values from ADC_probe.
+CalibrationProfile profile;  // Active temperature curve. Always has a precomputed table after setup.
 
 void IRAM_ATTR readEncoderISR() {
     rotaryEncoder.readEncoder_ISR();
@@ -131,30 +138,104 @@ void checkCompletion(float tempF) {
 }
 
 float calculateTemp(int ADC_raw) {
-    int x = ADC_raw;
-    float cal_tempF;
+    int raw = constrain(ADC_raw, 0, PROFILE_TABLE_SIZE - 1);
+    return profile.table[raw];
+}
+
+
+// Build a profile from the constants in preferences.h.
+void setDefaultProfile() {
+    profile = {};
+    profile.magic = PROFILE_MAGIC;
+    profile.version = PROFILE_VERSION;
+    profile.segment_count = 2;
     // Note: a lower value corresponds to higher temp.
-    if (ADC_raw <= upper_cutoff) {
-        cal_tempF = uA+(uB*x)+(uC*pow(x,2))+(uD*pow(x,3));
+    profile.segments[0] = {upper_cutoff, 0, uA, uB, uC, uD};
+    profile.segments[1] = {INT16_MAX, 0, A, B, C, D};
+}
+
+
+/*
+ * Load the calibration profile from the SD card with a single read.
+ * Falls back to preferences.h if the file is missing, the wrong size or fails its checksum.
+ * A table is precomputed from the segments if the file did not include one.
+*/
+void loadProfile() {
+    FsFile profileFile = SD.open(PROFILE_NAME, O_RDONLY);
+    bool loaded = false;
+    if (profileFile) {
+        profile = {};
+        int bytes = profileFile.read(&profile, sizeof(profile));
+        loaded = bytes >= static_cast<int>(PROFILE_MIN_FILE_SIZE)
+            && bytes == static_cast<int>(profileFileSize(profile))
+            && profileValid(profile);
+    }
+    profileFile.close();
+
+    if (loaded) {
+        Serial.print("Loaded calibration profile: ");
+        Serial.println(PROFILE_NAME);
     } else {
-        cal_tempF = A+(B*x)+(C*pow(x,2))+(D*pow(x,3));
+        Serial.println("No valid calibration profile. Using preferences.h constants.");
+        setDefaultProfile();
     }
-    return cal_tempF;
+
+    if (profile.table_size == 0) {
+        precomputeProfileTable(profile);
+    }
+}
+
+// Encode every sample in ADC_probe. Must be called before getMedian() which may reorder the buffer.
+size_t encodeRawBurst() {
+    size_t length = 0;
+    int16_t previous = 0;
+    for (int i = 0; i < ADC_probe.size(); ++i) {
+        int16_t sample = ADC_probe.getElement(i);
+        length += encodeSample(previous, sample, &raw_encode_buffer[length]);
+        previous = sample;
+    }
+    return length;
+}
+
+
+void writeRawBurst(size_t encoded_bytes, float tempF) {
+    RawBurstHeader burst = {static_cast<uint32_t>(millis()), tempF, static_cast<uint16_t>(ADC_probe.size()),
+                            static_cast<uint16_t>(encoded_bytes)};
+    rawFile.write(&burst, sizeof(burst));
+    rawFile.write(raw_encode_buffer.data(), encoded_bytes);
 }
 
 
 void runRecordData() {
     uint32_t run_count = 0;  // Approx up to 39480
+    size_t encoded_bytes = 0;
+    ThermalLag thermal_lag(lag_window, lag_max_shift, data_interval / 1000.0);
     if (dataFile) {
         resetBuffers();
         dataFile.truncate();
-        dataFile.println("\"Data Set: ADC Reading\",\"Data Set: Temp F\"");
+        if (compensate_lag) {
+            dataFile.println("\"Data Set: ADC Reading\",\"Data Set: Temp F\",\"Data Set: Lag Corrected Temp F\"");
+        } else {
+            dataFile.println("\"Data Set: ADC Reading\",\"Data Set: Temp F\"");
+        }
         Serial.println("\nRECORD_DATA");
     } else {
         Serial.println("\n!!!!!!!!!!!!!! Error opening .csv file !!!!!!!!!!!!!!!!!!");
         button_select = ButtonSelect::STANDBY_MODE;
     }
 
+    if (capture_raw && button_select == ButtonSelect::RECORD_DATA) {
+        rawFile = SD.open(RAW_FILE_NAME, FILE_TRUNC_WRITE);
+        if (rawFile) {
+            RawCaptureHeader header = {RAW_CAPTURE_MAGIC, RAW_CAPTURE_VERSION,
+                                       static_cast<uint16_t>(sample_size), static_cast<uint32_t>(data_interval)};
+            rawFile.write(&header, sizeof(header));
+        } else {
+            Serial.println("\n!!!!!!!!!!!!!! Error opening raw capture file !!!!!!!!!!!!!!!!!!");
+            button_select = ButtonSelect::STANDBY_MODE;
+        }
+    }
+
     while (button_select == ButtonSelect::RECORD_DATA) {
 
         if (data_interval_timer.expired()) {
@@ -170,6 +251,9 @@ void runRecordData() {
         if (ADC_probe.bufferFull()) {
             fetching_ADC_data = false;
             run_count++;
+            if (rawFile) {
+                encoded_bytes = encodeRawBurst();
+            }
             int raw;
             if (use_median) {
                 raw = ADC_probe.getMedian();
@@ -186,6 +270,11 @@ void runRecordData() {
                 Serial.println("Error: Could not read temp data from 1-wire sensor!");
                 button_select = ButtonSelect::STANDBY_MODE;
             } else {
+                float corrected_tempF = tempF;
+                if (compensate_lag) {
+                    // Negated so it rises with temp. Avoids depending on the curve being calibrated.
+                    corrected_tempF = thermal_lag.add(-raw, tempF);
+                }
                 Serial.print("SampleSize: ");
                 Serial.print(sample_size);
                 if (use_median) {
@@ -196,6 +285,16 @@ void runRecordData() {
                 Serial.print(raw);
                 Serial.print("   TempF: ");
                 Serial.print(tempF, 4);
+                if (compensate_lag) {
+                    if (thermal_lag.locked()) {
+                        Serial.print("   LagCorrectedF: ");
+                        Serial.print(corrected_tempF, 4);
+                        Serial.print("   Lag(s): ");
+                        Serial.print(thermal_lag.lagSeconds());
+                    } else {
+                        Serial.print("   Lag: NO LOCK");
+                    }
+                }
                 Serial.print("   EndTemp: ");
                 Serial.print(END_TEMP);
                 Serial.print("   count: ");
@@ -205,7 +304,19 @@ void runRecordData() {
                 // Save to dataFile
                 dataFile.print(raw);
                 dataFile.print(",");
-                dataFile.println(tempF, 4); // DS18B20 has resolution of 0.1125°F
+                if (compensate_lag) {
+                    dataFile.print(tempF, 4);
+                    dataFile.print(",");
+                    if (thermal_lag.locked()) {
+                        dataFile.print(corrected_tempF, 4);
+                    }
+                    dataFile.println();  // Corrected column is left empty until locked.
+                } else {
+                    dataFile.println(tempF, 4); // DS18B20 has resolution of 0.1125°F
+                }
+                if (rawFile) {
+                    writeRawBurst(encoded_bytes, tempF);
+                }
                 checkCompletion(tempF);  // Exits to STANDBY_MODE if done.
 
                 if (data_interval_timer.expired()) {
@@ -217,6 +328,23 @@ void runRecordData() {
         }
         handleRotaryButton();
     }
+
+    if (rawFile) {
+        rawFile.close();
+    }
+
+    if (compensate_lag && run_count > 0) {
+        Serial.print("Thermal Lag Blocks Used: ");
+        Serial.print(thermal_lag.acceptedBlocks());
+        Serial.print("   Rejected: ");
+        Serial.println(thermal_lag.rejectedBlocks());
+        if (thermal_lag.locked()) {
+            Serial.print("Final Lag(s): ");
+            Serial.println(thermal_lag.lagSeconds());
+        } else {
+            Serial.println("Thermal Lag: NO LOCK. No correction was applied.");
+        }
+    }
 }
 
 
@@ -379,6 +507,12 @@ void setup() {
         Serial.println("SD card initialization failed!");
     }
 
+    loadProfile();
+
+    if (capture_raw) {
+        raw_encode_buffer.resize(max_buffer_size * RAW_MAX_BYTES_PER_SAMPLE);
+    }
+
     dataFile = SD.open(FILE_NAME, FILE_TRUNC_WRITE);  // Will overwrite contents of file.
 }
 
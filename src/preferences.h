@@ -32,6 +32,30 @@ const int data_interval = 1000;
 const bool use_median = true;
 
 
+/* Save every ADC sample during RECORD_DATA to RAW_FILE_NAME.
+ * The capture can be replayed with ./extras/replay/replay.cpp to compare other sample sizes,
+ * median vs average and filters without another cool-down.
+ * Record using the largest sample size you might want to test.
+*/
+const bool capture_raw = false;
+
+
+/* Thermal lag compensation for RECORD_DATA.
+ * The DS18B20 and thermistor react to temp changes at different speeds, which adds an offset
+ * during a fast cool-down. When true the lag between them is estimated from the recorded data
+ * and a lag corrected DS18B20 temp is saved as a third column. The Temp F column is unchanged.
+ * The estimate needs changes in the cooling rate (stirring, ice cubes) to lock on to.
+ * Until it locks the third column is left empty.
+ * lag_window: number of readings in each block used to estimate lag. Should cover a few minutes.
+ * lag_max_shift: largest lag in readings that will be looked for.
+ * lag_window must be more than 2 * lag_max_shift + 2 or every block would be rejected.
+*/
+const bool compensate_lag = false;
+const int lag_window = 300;
+const int lag_max_shift = 30;
+static_assert(lag_window > 2 * lag_max_shift + 2, "lag_window must be more than 2 * lag_max_shift + 2");
+
+
 /* Temp (°F) and time (ms) to terminate RECORD_DATA.
  * Exits when END_TEMP or lower is reached for END_TEMP_TIME.
 */
@@ -51,6 +75,10 @@ const float B = -0.09784;
 const float C = 2.401E-05;
 const float D = -3.491E-09;
 
+/* The constants above and below are only defaults.
+ * A calibration profile on the SD card (PROFILE_NAME) overrides them without a reflash.
+*/
+
 /* Upper Raw Cutoff Value:
  * Any value at or below this number will use the upper temp formula values.
  * Lower values correspond to higher temps for NTC thermistors.
@@ -69,6 +97,15 @@ const float uD = -3.491E-09;
 // Name of the SD card file to save data to.
 const char *FILE_NAME = "probe_calibration.csv";
 
+// Name of the SD card file to save raw samples to when capture_raw is true.
+const char *RAW_FILE_NAME = "probe_raw.bin";
+
+/* Name of the SD card calibration profile loaded at startup.
+ * Create it with ./extras/make_profile.cpp.
+ * If the file is missing or invalid the constants above are used instead.
+*/
+const char *PROFILE_NAME = "thermistor.cal";
+
 // Baud rate for serial communication.
 const unsigned long BAUD_RATE = 115200;
 
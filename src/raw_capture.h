@@ -0,0 +1,81 @@
+#ifndef RAW_CAPTURE_H
+#define RAW_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Raw Sample Capture Format
+ * Written by RECORD_DATA when capture_raw is true and read by ./extras/replay/replay.cpp.
+ *
+ * File:  RawCaptureHeader, then one record per burst until end of file.
+ * Burst: RawBurstHeader, then encoded_bytes of samples in the order they were read.
+ * Each sample is stored as the zigzag varint of its difference from the previous sample
+ * (the first sample is compared to 0). Thermistor noise is usually only a few counts so
+ * most samples take 1 byte instead of 2.
+ *
+ * Layout is little-endian with no implicit padding.
+ * Change RAW_CAPTURE_VERSION whenever the layout changes.
+*/
+const uint32_t RAW_CAPTURE_MAGIC = 0x57415254;  // "TRAW" in a little-endian file
+const uint16_t RAW_CAPTURE_VERSION = 1;
+const int RAW_MAX_BYTES_PER_SAMPLE = 3;  // Worst case for a 16-bit difference.
+
+struct RawCaptureHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t sample_size;    // Samples per burst.
+    uint32_t data_interval;  // Time in ms between bursts.
+};
+
+struct RawBurstHeader {
+    uint32_t time_ms;  // millis() when the reference temp was read.
+    float tempF;       // DS18B20 reference temp.
+    uint16_t count;    // Number of samples in the burst.
+    uint16_t encoded_bytes;
+};
+
+static_assert(sizeof(RawCaptureHeader) == 12, "RawCaptureHeader layout changed");
+static_assert(sizeof(RawBurstHeader) == 12, "RawBurstHeader layout changed");
+
+
+// Encode sample relative to previous into out. Returns the number of bytes written.
+inline size_t encodeSample(int16_t previous, int16_t sample, uint8_t *out) {
+    int32_t delta = static_cast<int32_t>(sample) - previous;
+    uint32_t zigzag = (static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31);
+    size_t length = 0;
+    while (zigzag >= 0x80) {
+        out[length++] = static_cast<uint8_t>(zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    out[length++] = static_cast<uint8_t>(zigzag);
+    return length;
+}
+
+
+// Decode count samples from in. Returns false if the data runs out or is malformed.
+inline bool decodeSamples(const uint8_t *in, size_t length, int count, int16_t *samples) {
+    size_t pos = 0;
+    int16_t previous = 0;
+    for (int i = 0; i < count; ++i) {
+        uint32_t zigzag = 0;
+        int shift = 0;
+        while (true) {
+            if (pos >= length || shift > 14) {
+                return false;
+            }
+            uint8_t byte = in[pos++];
+            zigzag |= static_cast<uint32_t>(byte & 0x7F) << shift;
+            shift += 7;
+            if (!(byte & 0x80)) {
+                break;
+            }
+        }
+        int32_t delta = static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1);
+        previous = static_cast<int16_t>(previous + delta);
+        samples[i] = previous;
+    }
+    return pos == length;
+}
+
+
+#endif // RAW_CAPTURE_H
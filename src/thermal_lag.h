@@ -0,0 +1,277 @@
+#ifndef THERMAL_LAG_H
+#define THERMAL_LAG_H
+
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+/* Thermal Lag Compensation
+ * The thermistor and the DS18B20 respond to a change in water temp at different speeds.
+ * During a cool-down this shows up as an offset between the two, so the reference temps
+ * can be shifted to line up with the thermistor.
+ *
+ * The relative lag is estimated over separate blocks of `window` readings. For each lag tried,
+ * the faster stream is passed through a first-order filter with that time constant and
+ * correlated with the slower one. The noise each filter removes is accounted for, so a noisy
+ * ADC reading doesn't favour filtering the thermistor. A quadratic is removed from both first,
+ * so only changes in the cooling rate (stirring, an ice cube, topping up the water) are left
+ * to line up.
+ * A smooth cool-down leaves nothing to correlate: a lagged exponential cool-down is just a
+ * scaled one, so its lag can't be told apart from the calibration curve. Blocks like that
+ * are rejected and the estimate stays unlocked rather than guessing.
+ *
+ * A block is only used when the reference residual is well above DS18B20 resolution and the
+ * best correlation is strong and not at the edge of the search. Once MIN_BLOCKS blocks are
+ * accepted the lag is their correlation weighted average. Treating it as a first-order lag:
+ *   Reference slower (lag > 0): corrected = reference + lag * d(reference)/dt
+ *   Reference faster (lag < 0): reference is passed through a first-order filter with tau = -lag
+ *
+ * The thermistor stream only needs to rise with temp, so a negated raw ADC reading can be used
+ * directly. That keeps the estimate independent of the curve being calibrated.
+*/
+class ThermalLag {
+public:
+    // window and max_shift are in readings. interval is the time between readings in seconds.
+    ThermalLag(int window, int max_shift, float interval)
+        : window_(window), max_shift_(max_shift), interval_(interval) {}
+
+    // Add a pair of readings and return the reference corrected for lag (unchanged until locked).
+    float add(float thermistor_signal, float reference_tempF) {
+        push(thermistor_, thermistor_signal);
+        push(reference_, reference_tempF);
+        readings_++;
+        if (readings_ % window_ == 0) {
+            estimateLag();
+        }
+
+        if (readings_ == 1) {
+            filtered_ = reference_tempF;
+        }
+        float tau = locked() ? -lag_ : 0.0;
+        filtered_ += (reference_tempF - filtered_) * interval_ / (fmaxf(tau, 0.0) + interval_);
+
+        if (!locked()) {
+            return reference_tempF;
+        } else if (lag_ > 0) {
+            return reference_tempF + lag_ * referenceSlope();
+        } else {
+            return filtered_;
+        }
+    }
+
+    // True once enough blocks agree to trust the estimate.
+    bool locked() const { return accepted_ >= MIN_BLOCKS; }
+
+    // Estimated time in seconds the reference lags the thermistor. Negative if it leads.
+    float lagSeconds() const { return lag_; }
+
+    // Smallest window must be above this for a given max_shift. Also checked in preferences.h.
+    static constexpr int minWindow(int max_shift) { return 2 * max_shift + 2; }
+
+    // Number of blocks used in the estimate and number rejected.
+    int acceptedBlocks() const { return accepted_; }
+    int rejectedBlocks() const { return rejected_; }
+
+private:
+    static constexpr int SLOPE_SPAN = 30;            // Readings used to get d(reference)/dt.
+    static constexpr int MIN_BLOCKS = 2;             // Accepted blocks needed to lock.
+    static constexpr float MIN_CORRELATION = 0.8;    // Weaker peaks are rejected.
+    static constexpr float DS18B20_STEP_F = 0.1125;  // DS18B20 12-bit resolution in °F.
+    static constexpr float MIN_RESIDUAL_F = 0.15;    // About 5x the RMS error of 0.1125°F steps.
+
+    int window_;
+    int max_shift_;
+    float interval_;
+    long readings_ = 0;
+    int accepted_ = 0;
+    int rejected_ = 0;
+    float lag_ = 0.0;
+    float filtered_ = 0.0;
+    float lag_sum_ = 0.0;     // Correlation weighted sum of block estimates.
+    float weight_sum_ = 0.0;
+    std::vector<float> thermistor_;
+    std::vector<float> reference_;
+
+    void push(std::vector<float> &buffer, float value) {
+        if (static_cast<int>(buffer.size()) == window_) {
+            buffer.erase(buffer.begin());
+        }
+        buffer.push_back(value);
+    }
+
+    // Subtract the least squares quadratic so a smooth cool-down leaves only noise.
+    static std::vector<float> detrend(const std::vector<float> &y) {
+        int n = y.size();
+        float half = (n - 1) / 2.0;
+        // Centered and scaled x keeps the normal equations well conditioned.
+        double s[5] = {}, sy[3] = {};
+        for (int i = 0; i < n; ++i) {
+            double x = (i - half) / half;
+            double p = 1.0;
+            for (int k = 0; k < 5; ++k) {
+                s[k] += p;
+                if (k < 3) {
+                    sy[k] += p * y[i];
+                }
+                p *= x;
+            }
+        }
+        double m[3][4] = {{s[0], s[1], s[2], sy[0]},
+                          {s[1], s[2], s[3], sy[1]},
+                          {s[2], s[3], s[4], sy[2]}};
+        for (int col = 0; col < 3; ++col) {
+            for (int r = 0; r < 3; ++r) {
+                if (r != col) {
+                    double factor = m[r][col] / m[col][col];
+                    for (int c = col; c < 4; ++c) {
+                        m[r][c] -= factor * m[col][c];
+                    }
+                }
+            }
+        }
+        double a = m[0][3] / m[0][0], b = m[1][3] / m[1][1], c = m[2][3] / m[2][2];
+        std::vector<float> residual(n);
+        for (int i = 0; i < n; ++i) {
+            double x = (i - half) / half;
+            residual[i] = y[i] - (a + b * x + c * x * x);
+        }
+        return residual;
+    }
+
+    static float rms(const std::vector<float> &y) {
+        float sum = 0.0;
+        for (float v : y) {
+            sum += v * v;
+        }
+        return sqrtf(sum / y.size());
+    }
+
+    // First-order low pass of y with time constant tau seconds, starting at the first value.
+    std::vector<float> lowPass(const std::vector<float> &y, float tau) const {
+        std::vector<float> out(y.size());
+        float alpha = interval_ / (tau + interval_);
+        float state = y[0];
+        for (size_t i = 0; i < y.size(); ++i) {
+            state += (y[i] - state) * alpha;
+            out[i] = state;
+        }
+        return out;
+    }
+
+    // Drop the first max_shift readings while the filters settle.
+    std::vector<float> settled(std::vector<float> y) const {
+        y.erase(y.begin(), y.begin() + max_shift_);
+        return y;
+    }
+
+    // Fraction of white noise power that gets through lowPass with time constant tau.
+    float noiseGain(float tau) const {
+        float alpha = interval_ / (tau + interval_);
+        return alpha / (2.0 - alpha);
+    }
+
+    // Robust white noise variance from second differences (their variance is 6x the noise).
+    static float noiseVariance(const std::vector<float> &y) {
+        std::vector<float> d2;
+        for (size_t i = 2; i < y.size(); ++i) {
+            d2.push_back(fabsf(y[i] - 2 * y[i - 1] + y[i - 2]));
+        }
+        std::nth_element(d2.begin(), d2.begin() + d2.size() / 2, d2.end());
+        float sigma = d2[d2.size() / 2] / 0.6745;  // Median absolute value to std deviation.
+        return sigma * sigma / 6.0;
+    }
+
+    /*
+     * Correlation after lagging the faster stream by |lag| seconds with a first-order filter,
+     * the same model used for the correction.
+     * Filtering a stream also removes some of its noise, which alone would raise the plain
+     * correlation and pull the estimate toward filtering the noisier stream. So the noise left
+     * after filtering is taken out of each variance first, making the comparison the same for
+     * every lag. t_noise is the thermistor's noise variance, r_noise the reference's.
+     */
+    float modelCorrelation(float lag, float t_noise, float r_noise) const {
+        std::vector<float> t = detrend(settled(lag > 0 ? lowPass(thermistor_, lag) : thermistor_));
+        std::vector<float> r = detrend(settled(lag < 0 ? lowPass(reference_, -lag) : reference_));
+        float sum_tr = 0.0, sum_tt = 0.0, sum_rr = 0.0;
+        for (size_t i = 0; i < t.size(); ++i) {
+            sum_tr += t[i] * r[i];
+            sum_tt += t[i] * t[i];
+            sum_rr += r[i] * r[i];
+        }
+        int n = t.size();
+        float var_t = sum_tt / n - t_noise * noiseGain(fmaxf(lag, 0.0));
+        float var_r = sum_rr / n - r_noise * noiseGain(fmaxf(-lag, 0.0));
+        if (var_t <= 0.0 || var_r <= 0.0) {
+            return 0.0;
+        }
+        return sum_tr / n / sqrtf(var_t * var_r);
+    }
+
+    // Estimate the lag over the last window readings, which don't overlap the previous block.
+    void estimateLag() {
+        if (window_ <= minWindow(max_shift_)) {
+            rejected_++;
+            return;
+        }
+        if (rms(detrend(reference_)) < MIN_RESIDUAL_F) {
+            rejected_++;
+            return;
+        }
+
+        float t_noise = noiseVariance(thermistor_);
+        float r_noise = DS18B20_STEP_F * DS18B20_STEP_F / 12.0;  // Rounding to 0.1125°F steps.
+
+        // Search lags from -max_shift to +max_shift readings in half reading steps.
+        int steps = 4 * max_shift_ + 1;
+        std::vector<float> corr(steps);
+        int best = 0;
+        for (int k = 0; k < steps; ++k) {
+            corr[k] = modelCorrelation((k - 2 * max_shift_) * 0.5 * interval_, t_noise, r_noise);
+            if (corr[k] > corr[best]) {
+                best = k;
+            }
+        }
+        // A peak at the edge of the search means the real lag wasn't found.
+        if (corr[best] < MIN_CORRELATION || best == 0 || best == steps - 1) {
+            rejected_++;
+            return;
+        }
+
+        // Parabolic interpolation between neighbouring steps.
+        float offset = 0.0;
+        float denom = corr[best - 1] - 2 * corr[best] + corr[best + 1];
+        if (denom < 0.0) {
+            offset = 0.5 * (corr[best - 1] - corr[best + 1]) / denom;
+        }
+        float estimate = (best - 2 * max_shift_ + offset) * 0.5 * interval_;
+        lag_sum_ += corr[best] * estimate;
+        weight_sum_ += corr[best];
+        lag_ = lag_sum_ / weight_sum_;
+        accepted_++;
+    }
+
+    // Least squares slope of the most recent reference temps in °F per second.
+    float referenceSlope() const {
+        int span = SLOPE_SPAN;  // Local copy, std::min takes a reference.
+        int n = std::min(static_cast<int>(reference_.size()), span);
+        if (n < 2) {
+            return 0.0;
+        }
+        int first = reference_.size() - n;
+        float mean_x = (n - 1) / 2.0;
+        float mean_y = 0.0;
+        for (int i = 0; i < n; ++i) {
+            mean_y += reference_[first + i];
+        }
+        mean_y /= n;
+        float sum_xy = 0.0, sum_xx = 0.0;
+        for (int i = 0; i < n; ++i) {
+            sum_xy += (i - mean_x) * (reference_[first + i] - mean_y);
+            sum_xx += (i - mean_x) * (i - mean_x);
+        }
+        return sum_xy / sum_xx / interval_;
+    }
+};
+
+
+#endif // THERMAL_LAG_H